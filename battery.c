@@ -0,0 +1,230 @@
+/*
+ * LT8491 - Buck/Boost Battery Charger with MPPT
+ * Copyright (C) 2021 Craig Peacock
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "lt8491.h"
+#include "battery.h"
+
+/*
+ * Online state of charge / state of health estimator.
+ *
+ * The LT8491 only measures current into the battery, so SoC is coulomb
+ * counted while charging and re-anchored to 100% when the charger reaches
+ * float or complete. Once resting (no charging and no output current for
+ * BATTERY_REST_TIME) the estimate is pulled towards the open circuit voltage
+ * with a time constant of BATTERY_REST_TAU. A charge cycle that
+ * starts from a rested SoC and runs through to float gives a measurement
+ * of usable capacity, which is filtered into SoH. Each update is O(1).
+ *
+ * State is saved on anchor and charge cycle transitions, and otherwise at
+ * most every BATTERY_SAVE_INTERVAL seconds to limit flash wear.
+ */
+
+static float battery_clamp(float value, float min, float max)
+{
+	if (value < min) return(min);
+	if (value > max) return(max);
+	return(value);
+}
+
+static float battery_temp_factor(float tbat)
+{
+	return(battery_clamp(1.0 + BATTERY_TEMPCO * (tbat - 25.0), 0.5, 1.2));
+}
+
+static float battery_soc_from_voltage(struct BATTERY *battery, float vbat)
+{
+	return(battery_clamp((vbat - battery->vempty) / (battery->vfull - battery->vempty) * 100, 0, 100));
+}
+
+static void battery_load(struct BATTERY *battery)
+{
+	FILE *fhandle;
+	float soc, soh, ah_charged, soc_start;
+	int cycle_active, valid;
+	long last;
+
+	fhandle = fopen(battery->statefile, "r");
+	if (fhandle == NULL) return;
+
+	if (fscanf(fhandle, "%f %f %f %f %d %d %ld", &soc, &soh, &ah_charged, &soc_start, &cycle_active, &valid, &last) == 7
+			&& soh >= 0 && soh <= 100 && soc >= 0 && soc <= 100) {
+		battery->soh = soh;
+		battery->last = (time_t) last;
+		// SoC is only meaningful once it has been anchored
+		if (valid) {
+			battery->soc = soc;
+			battery->ah_charged = ah_charged;
+			battery->soc_start = soc_start;
+			battery->cycle_active = cycle_active;
+			battery->valid = true;
+			printf("Resuming battery state: SoC %.01f%%, SoH %.01f%%\r\n", battery->soc, battery->soh);
+		} else {
+			printf("Resuming battery state: SoC unknown, SoH %.01f%%\r\n", battery->soh);
+		}
+	} else {
+		printf("Ignoring invalid battery state in %s\r\n", battery->statefile);
+	}
+	fclose(fhandle);
+}
+
+static void battery_save(struct BATTERY *battery)
+{
+	FILE *fhandle;
+	char tmpname[BATTERY_PATH_MAX];
+
+	// Write to a temporary file, sync and rename so power loss never leaves a partial state
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", battery->statefile);
+	fhandle = fopen(tmpname, "w");
+	if (fhandle == NULL) {
+		printf("Unable to open %s for writing\r\n", tmpname);
+		return;
+	}
+	fprintf(fhandle, "%f %f %f %f %d %d %ld\n",
+			battery->soc,
+			battery->soh,
+			battery->ah_charged,
+			battery->soc_start,
+			battery->valid && battery->cycle_active,
+			battery->valid,
+			(long) battery->last);
+	if (fflush(fhandle) != 0 || fsync(fileno(fhandle)) != 0) {
+		printf("Unable to write %s: %s\r\n", tmpname, strerror(errno));
+		fclose(fhandle);
+		return;
+	}
+	if (fclose(fhandle) != 0) {
+		printf("Unable to write %s: %s\r\n", tmpname, strerror(errno));
+		return;
+	}
+	if (rename(tmpname, battery->statefile) != 0) {
+		printf("Unable to rename %s to %s: %s\r\n", tmpname, battery->statefile, strerror(errno));
+		return;
+	}
+	battery->saved = battery->last;
+}
+
+void battery_init(struct BATTERY *battery, float capacity, float vempty, float vfull, char *statefile)
+{
+	battery->capacity = capacity;
+	battery->vempty = vempty;
+	battery->vfull = vfull;
+	battery->soc = 0;
+	battery->soh = 100;
+	battery->ah_charged = 0;
+	battery->soc_start = 0;
+	battery->cycle_active = false;
+	battery->valid = false;
+	battery->last = 0;
+	battery->saved = 0;
+	battery->rest_since = 0;
+	battery->statefile = statefile;
+
+	if (statefile != NULL) {
+		// Leave room for the temporary file suffix
+		if (strlen(statefile) + sizeof(".tmp") > BATTERY_PATH_MAX) {
+			printf("State file name %s is too long\r\n", statefile);
+			exit(1);
+		}
+		battery_load(battery);
+	}
+}
+
+void battery_update(struct BATTERY *battery, time_t now, struct TELEMETRY *telemetry, struct STATUS *status)
+{
+	float capacity;
+	float ah;
+	float soh;
+	double dt;
+	double weight;
+	bool charging = status->charger.bits.charging;
+	uint8_t stage = status->charger.bits.chrg_stage;
+	bool save = false;
+
+	// Usable capacity at the present battery temperature
+	capacity = battery->capacity * battery->soh / 100 * battery_temp_factor(telemetry->tbat);
+
+	dt = difftime(now, battery->last);
+	if (battery->last == 0 || dt <= 0 || dt > BATTERY_MAX_GAP) dt = 0;
+	if (dt > 0 && capacity > 0) {
+		ah = telemetry->iout * dt / 3600;
+		battery->soc = battery_clamp(battery->soc + ah * BATTERY_CHARGE_EFF / capacity * 100, 0, 100);
+		if (battery->cycle_active) battery->ah_charged += ah;
+	}
+	battery->last = now;
+
+	if (charging && (stage == 0b011 || stage == 0b100)) {
+		// Float or complete: battery is full
+		if (battery->cycle_active && 100 - battery->soc_start >= BATTERY_SOH_MIN_SPAN) {
+			// Capacity measured over this cycle, normalised to 25degC
+			soh = battery->ah_charged * BATTERY_CHARGE_EFF / ((100 - battery->soc_start) / 100)
+				/ battery_temp_factor(telemetry->tbat) / battery->capacity * 100;
+			battery->soh = battery_clamp(battery->soh + BATTERY_SOH_ALPHA * (soh - battery->soh), 0, 100);
+		}
+		if (battery->soc != 100 || battery->cycle_active || !battery->valid) save = true;
+		battery->soc = 100;
+		battery->cycle_active = false;
+		battery->valid = true;
+		battery->rest_since = 0;
+
+	} else if (charging) {
+		// Start of a charge cycle from a known SoC
+		if (!battery->cycle_active && battery->valid) {
+			battery->soc_start = battery->soc;
+			battery->ah_charged = 0;
+			battery->cycle_active = true;
+			save = true;
+		}
+		battery->rest_since = 0;
+
+	} else if (telemetry->iout < BATTERY_REST_CURRENT) {
+		// Only treat the battery as resting once the charger has been off for a while,
+		// so brief dropouts don't end the charge cycle or anchor to a surface charge
+		if (battery->rest_since == 0) battery->rest_since = now;
+
+		if (difftime(now, battery->rest_since) >= BATTERY_REST_TIME) {
+			// Resting: anchor to open circuit voltage
+			if (battery->cycle_active || !battery->valid) save = true;
+			if (battery->valid) {
+				weight = dt / BATTERY_REST_TAU;
+				if (weight > 1) weight = 1;
+				battery->soc += weight * (battery_soc_from_voltage(battery, telemetry->vbat) - battery->soc);
+			} else {
+				battery->soc = battery_soc_from_voltage(battery, telemetry->vbat);
+			}
+			battery->cycle_active = false;
+			battery->valid = true;
+		}
+
+	} else {
+		battery->rest_since = 0;
+	}
+
+	// Save on transitions, otherwise only periodically
+	if (battery->statefile != NULL && (save || difftime(now, battery->saved) >= BATTERY_SAVE_INTERVAL))
+		battery_save(battery);
+}
@@ -0,0 +1,63 @@
+/*
+ * LT8491 - Buck/Boost Battery Charger with MPPT
+ * Copyright (C) 2021 Craig Peacock
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef MAIN_BATTERY_H_
+#define MAIN_BATTERY_H_
+
+#include <stdbool.h>
+#include <time.h>
+
+#define BATTERY_CAPACITY_AH		100.0	// Default nominal capacity (Ah) at 25degC
+#define BATTERY_CHARGE_EFF		0.95	// Coulombic efficiency while charging
+#define BATTERY_TEMPCO			0.006	// Capacity change per degC from 25degC
+#define BATTERY_VEMPTY			11.8	// Default resting voltage at 0% SoC (12V lead acid)
+#define BATTERY_VFULL			12.7	// Default resting voltage at 100% SoC (12V lead acid)
+#define BATTERY_REST_CURRENT		0.05	// Output current below which the battery may be resting (A)
+#define BATTERY_REST_TIME		1800	// Time without charge before anchoring to resting voltage (s)
+#define BATTERY_REST_TAU		3600	// Time constant when anchoring to resting voltage (s)
+#define BATTERY_SOH_ALPHA		0.2	// Filter weight for each new capacity measurement
+#define BATTERY_SOH_MIN_SPAN		50.0	// Minimum SoC span (%) for a capacity measurement
+#define BATTERY_MAX_GAP			300	// Don't integrate across gaps longer than this (s)
+#define BATTERY_SAVE_INTERVAL		600	// Maximum time between state saves (s)
+#define BATTERY_PATH_MAX		256	// Maximum state file name length, including suffix
+
+struct TELEMETRY;
+struct STATUS;
+
+struct BATTERY {
+	float capacity;		// Nominal capacity (Ah)
+	float vempty;		// Resting voltage at 0% SoC
+	float vfull;		// Resting voltage at 100% SoC
+	float soc;		// State of charge (%)
+	float soh;		// State of health (%)
+	float ah_charged;	// Charge delivered since start of charge cycle (Ah)
+	float soc_start;	// SoC at start of charge cycle (%)
+	bool cycle_active;
+	bool valid;		// SoC has been anchored at least once
+	time_t last;		// Time of last update
+	time_t saved;		// Time of last state save
+	time_t rest_since;	// Time charging stopped (0 if not resting)
+	char *statefile;
+};
+
+void battery_init(struct BATTERY *battery, float capacity, float vempty, float vfull, char *statefile);
+void battery_update(struct BATTERY *battery, time_t now, struct TELEMETRY *telemetry, struct STATUS *status);
+
+#endif
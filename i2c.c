@@ -34,7 +34,7 @@ uint32_t i2c_init(char *devname)
 {
 	int handle;
 
-	if ((handle = open(devname, O_RDWR)) < 0) {
+	if ((handle = open(devname, O_RDWR | O_CLOEXEC)) < 0) {
 		printf("Failed to open I2C port\r\n");
 		exit(1);
 	}
@@ -28,6 +28,8 @@
 #include <time.h>
 #include "i2c.h"
 #include "lt8491.h"
+#include "battery.h"
+#include "rules.h"
 
 static void print_usage(char *prg)
 {
@@ -36,6 +38,11 @@ static void print_usage(char *prg)
 	fprintf(stderr, "	-l <filename> 		Log to file\n");
 	fprintf(stderr, "	-p <i2c device> 	I2C port\n");
 	fprintf(stderr, "	-a <i2c addr> 		I2C address of power meter (in hex)\n");
+	fprintf(stderr, "	-c <capacity> 		Battery capacity in Ah (default %.0f)\n", BATTERY_CAPACITY_AH);
+	fprintf(stderr, "	-e <voltage> 		Battery resting voltage at 0%% SoC (default %.1f, 12V lead acid)\n", BATTERY_VEMPTY);
+	fprintf(stderr, "	-f <voltage> 		Battery resting voltage at 100%% SoC (default %.1f, 12V lead acid)\n", BATTERY_VFULL);
+	fprintf(stderr, "	-s <filename> 		Persist battery SoC/SoH state to file\n");
+	fprintf(stderr, "	-r <filename> 		Load alert rules from file\n");
 	fprintf(stderr, "\n");
 }
 
@@ -46,13 +53,19 @@ int main(int argc, char **argv)
 	unsigned char i2caddr = 0x10;
 	char * logfilename = NULL;
 	bool logtofile = false;
+	float capacity = BATTERY_CAPACITY_AH;
+	float vempty = BATTERY_VEMPTY;
+	float vfull = BATTERY_VFULL;
+	char * endptr;
+	char * statefilename = NULL;
+	char * rulesfilename = NULL;
 
 	printf("LT8491 - Buck/Boost Battery Charger with MPPT\r\n");
 	printf("https://github.com/craigpeacock/LT8491\r\n");
 
 	int opt;
 
-	while ((opt = getopt(argc, argv, "l:p:a:?")) != -1) {
+	while ((opt = getopt(argc, argv, "l:p:a:c:e:f:s:r:?")) != -1) {
 		switch (opt) {
 			case 'l':
 				logfilename = (char *)optarg;
@@ -64,6 +77,33 @@ int main(int argc, char **argv)
 			case 'a':
 				i2caddr = (unsigned char) strtol((char *)optarg, NULL, 16);
 				break;
+			case 'c':
+				capacity = strtof((char *)optarg, &endptr);
+				if (*endptr != '\0' || !(capacity > 0)) {
+					print_usage(basename(argv[0]));
+					exit(1);
+				}
+				break;
+			case 'e':
+				vempty = strtof((char *)optarg, &endptr);
+				if (*endptr != '\0' || !(vempty > 0)) {
+					print_usage(basename(argv[0]));
+					exit(1);
+				}
+				break;
+			case 'f':
+				vfull = strtof((char *)optarg, &endptr);
+				if (*endptr != '\0' || !(vfull > 0)) {
+					print_usage(basename(argv[0]));
+					exit(1);
+				}
+				break;
+			case 's':
+				statefilename = (char *)optarg;
+				break;
+			case 'r':
+				rulesfilename = (char *)optarg;
+				break;
 
 			default:
 				print_usage(basename(argv[0]));
@@ -72,11 +112,16 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (vfull <= vempty) {
+		printf("Full voltage must be greater than empty voltage\r\n");
+		exit(1);
+	}
+
 	FILE *fhandle;
 
 	if (logtofile) {
 			printf("Logging to %s\r\n",logfilename);
-			fhandle = fopen(logfilename,"a+");
+			fhandle = fopen(logfilename,"a+e");
 			if (fhandle == NULL) {
 				printf("Unable to open %s for writing\r\n",logfilename);
 				exit(1);
@@ -90,6 +135,12 @@ int main(int argc, char **argv)
 
 	struct TELEMETRY tele;
 	struct STATUS stat;
+	struct BATTERY batt;
+
+	struct RULES rules;
+
+	battery_init(&batt, capacity, vempty, vfull, statefilename);
+	if (rulesfilename != NULL) rules_load(&rules, rulesfilename);
 
 	time_t now;
 	struct tm timeinfo;
@@ -158,7 +209,15 @@ int main(int argc, char **argv)
 		lt8491_telemetry(hI2C, i2caddr, &tele);
 		printf("PV Solar: %.02fV, %.02fA, %.02fW (%.02fW)\r\n", tele.vinr, tele.iin, tele.pin, tele.vinr*tele.iin);
 		printf("Battery:  %.02fV, %.02fA, %.02fW (%.02fW), %.01fdegC\r\n", tele.vbat, tele.iout, tele.pout, tele.vbat*tele.iout, tele.tbat);
-		printf("Efficiency: %.01f%% (%.01f%%)\r\n\r\n", tele.eff, (tele.vbat*tele.iout)/(tele.vinr*tele.iin)*100);
+		printf("Efficiency: %.01f%% (%.01f%%)\r\n", tele.eff, (tele.vbat*tele.iout)/(tele.vinr*tele.iin)*100);
+
+		// Update battery state estimate
+		battery_update(&batt, now, &tele, &stat);
+		if (batt.valid) printf("State:    SoC %.01f%%, SoH %.01f%%\r\n\r\n", batt.soc, batt.soh);
+		else printf("State:    SoC unknown, SoH %.01f%%\r\n\r\n", batt.soh);
+
+		// Check alert rules
+		if (rulesfilename != NULL) rules_evaluate(&rules, now, &tele, &stat, &batt);
 
 		if (logtofile) {
 
@@ -225,6 +284,11 @@ int main(int argc, char **argv)
 			} else {
 				fprintf(fhandle,"-");
 			}
+
+			// Battery State
+			if (batt.valid) fprintf(fhandle,",%.01f,%.01f", batt.soc, batt.soh);
+			else fprintf(fhandle,",,%.01f", batt.soh);
+
 			fprintf(fhandle,"\r\n");
 			fflush(fhandle);
 		}
@@ -0,0 +1,301 @@
+/*
+ * LT8491 - Buck/Boost Battery Charger with MPPT
+ * Copyright (C) 2021 Craig Peacock
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "lt8491.h"
+#include "battery.h"
+#include "rules.h"
+
+/*
+ * Threshold and alert rules, evaluated on every sample.
+ *
+ * Rules are read from a config file, one per line:
+ *
+ *   # name     field  op  threshold  hysteresis  holdoff  action
+ *   low_vbat   vbat   <   11.8       0.2         30       exec:/usr/local/bin/alert
+ *   high_tbat  tbat   >   45         2           10       unix:/run/lt8491.sock
+ *   tbat_fault faults &   0x03       0           0        exec:logger LT8491 fault
+ *
+ * Operators are < <= > >= == != and & (any bit set). Field names are
+ * resolved once at load time to a structure offset, so evaluation is a
+ * table walk with no string handling. A rule fires once the condition has
+ * held for holdoff seconds and clears once the value is back past the
+ * threshold by the hysteresis. Both transitions run the action: exec runs
+ * the command through /bin/sh with LT8491_RULE, LT8491_STATE and
+ * LT8491_VALUE set, unix sends a datagram to a local socket. Rules on soc
+ * and soh are held until the battery estimator has anchored.
+ */
+
+struct FIELD {
+	char *name;
+	uint8_t source;
+	uint8_t offset;
+	uint8_t shift;
+	uint8_t mask;
+};
+
+static const struct FIELD fields[] = {
+	{ "tbat",		RULE_SRC_TELE, offsetof(struct TELEMETRY, tbat), 0, 0 },
+	{ "pout",		RULE_SRC_TELE, offsetof(struct TELEMETRY, pout), 0, 0 },
+	{ "pin",		RULE_SRC_TELE, offsetof(struct TELEMETRY, pin),  0, 0 },
+	{ "eff",		RULE_SRC_TELE, offsetof(struct TELEMETRY, eff),  0, 0 },
+	{ "iout",		RULE_SRC_TELE, offsetof(struct TELEMETRY, iout), 0, 0 },
+	{ "iin",		RULE_SRC_TELE, offsetof(struct TELEMETRY, iin),  0, 0 },
+	{ "vbat",		RULE_SRC_TELE, offsetof(struct TELEMETRY, vbat), 0, 0 },
+	{ "vin",		RULE_SRC_TELE, offsetof(struct TELEMETRY, vin),  0, 0 },
+	{ "vinr",		RULE_SRC_TELE, offsetof(struct TELEMETRY, vinr), 0, 0 },
+	{ "charger",		RULE_SRC_STAT, offsetof(struct STATUS, charger), 0, 0xFF },
+	{ "charging",		RULE_SRC_STAT, offsetof(struct STATUS, charger), 2, 0x01 },
+	{ "chrg_stage",		RULE_SRC_STAT, offsetof(struct STATUS, charger), 3, 0x07 },
+	{ "chrg_fault",		RULE_SRC_STAT, offsetof(struct STATUS, charger), 7, 0x01 },
+	{ "system",		RULE_SRC_STAT, offsetof(struct STATUS, system),  0, 0xFF },
+	{ "supply",		RULE_SRC_STAT, offsetof(struct STATUS, supply),  0, 0xFF },
+	{ "solar_state",	RULE_SRC_STAT, offsetof(struct STATUS, supply),  0, 0x07 },
+	{ "vin_uvlo",		RULE_SRC_STAT, offsetof(struct STATUS, supply),  4, 0x01 },
+	{ "faults",		RULE_SRC_STAT, offsetof(struct STATUS, faults),  0, 0xFF },
+	{ "soc",		RULE_SRC_BATT, offsetof(struct BATTERY, soc), 0, 0 },
+	{ "soh",		RULE_SRC_BATT, offsetof(struct BATTERY, soh), 0, 0 },
+};
+
+static const char *ops[] = { "<", "<=", ">", ">=", "==", "!=", "&" };
+
+static int rules_compile(struct RULE *rule, char *field, char *op, char *action)
+{
+	size_t i;
+	struct sockaddr_un addr;
+
+	for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		if (strcmp(field, fields[i].name) == 0) break;
+	}
+	if (i == sizeof(fields) / sizeof(fields[0])) return(-1);
+	rule->source = fields[i].source;
+	rule->offset = fields[i].offset;
+	rule->shift = fields[i].shift;
+	rule->mask = fields[i].mask;
+
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if (strcmp(op, ops[i]) == 0) break;
+	}
+	if (i == sizeof(ops) / sizeof(ops[0])) return(-1);
+	rule->op = i;
+
+	if (strncmp(action, "exec:", 5) == 0) {
+		rule->action = RULE_ACTION_EXEC;
+	} else if (strncmp(action, "unix:", 5) == 0) {
+		rule->action = RULE_ACTION_UNIX;
+	} else {
+		return(-1);
+	}
+	if (strlen(action + 5) == 0 || strlen(action + 5) >= sizeof(rule->target)) return(-1);
+	if (rule->action == RULE_ACTION_UNIX && strlen(action + 5) >= sizeof(addr.sun_path)) return(-1);
+	strcpy(rule->target, action + 5);
+
+	return(0);
+}
+
+int rules_load(struct RULES *rules, char *filename)
+{
+	FILE *fhandle;
+	char line[256];
+	char field[16], op[4], threshold[16];
+	int lineno = 0;
+	int pos;
+	char *endptr;
+	struct RULE *rule;
+
+	rules->count = 0;
+	rules->sock = -1;
+
+	fhandle = fopen(filename, "r");
+	if (fhandle == NULL) {
+		printf("Unable to open %s\r\n", filename);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), fhandle) != NULL) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[strspn(line, " \t")] == '\0' || line[strspn(line, " \t")] == '#') continue;
+
+		if (rules->count == RULES_MAX) {
+			printf("Too many rules in %s (max %d)\r\n", filename, RULES_MAX);
+			exit(1);
+		}
+		rule = &rules->rule[rules->count];
+		memset(rule, 0, sizeof(*rule));
+
+		if (sscanf(line, "%31s %15s %3s %15s %f %d %n", rule->name, field, op, threshold,
+				&rule->hysteresis, &rule->holdoff, &pos) != 6
+				|| rules_compile(rule, field, op, line + pos) < 0
+				|| rule->hysteresis < 0 || rule->holdoff < 0) {
+			printf("Invalid rule at %s:%d\r\n", filename, lineno);
+			exit(1);
+		}
+		// Accept hex thresholds for bit masks
+		if (strncmp(threshold, "0x", 2) == 0)
+			rule->threshold = strtol(threshold, &endptr, 16);
+		else
+			rule->threshold = strtof(threshold, &endptr);
+		if (endptr == threshold || *endptr != '\0') {
+			printf("Invalid rule at %s:%d\r\n", filename, lineno);
+			exit(1);
+		}
+
+		if (rule->action == RULE_ACTION_UNIX && rules->sock < 0) {
+			rules->sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+			if (rules->sock < 0) {
+				printf("Unable to create alert socket\r\n");
+				exit(1);
+			}
+		}
+		rules->count++;
+	}
+	fclose(fhandle);
+
+	// Let exec actions run without being waited on
+	signal(SIGCHLD, SIG_IGN);
+
+	printf("Loaded %d rules from %s\r\n", rules->count, filename);
+	return(rules->count);
+}
+
+static void rules_fire(struct RULES *rules, struct RULE *rule, float value)
+{
+	char msg[128];
+	char *state = rule->active ? "ALERT" : "CLEAR";
+	struct sockaddr_un addr;
+	int len;
+	pid_t pid;
+
+	len = snprintf(msg, sizeof(msg), "%s %s %.03f\n", state, rule->name, value);
+	printf("Rule %s: %s (%.03f)\r\n", rule->name, state, value);
+
+	switch (rule->action) {
+		case RULE_ACTION_UNIX:
+			memset(&addr, 0, sizeof(addr));
+			addr.sun_family = AF_UNIX;
+			// Length checked against sun_path when the rule was compiled
+			memcpy(addr.sun_path, rule->target, strlen(rule->target) + 1);
+			if (sendto(rules->sock, msg, len, MSG_DONTWAIT, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+				printf("Unable to send alert to %s\r\n", rule->target);
+			break;
+
+		case RULE_ACTION_EXEC:
+			pid = fork();
+			if (pid < 0) {
+				printf("Unable to run alert command for %s\r\n", rule->name);
+			} else if (pid == 0) {
+				snprintf(msg, sizeof(msg), "%.03f", value);
+				setenv("LT8491_RULE", rule->name, 1);
+				setenv("LT8491_STATE", state, 1);
+				setenv("LT8491_VALUE", msg, 1);
+				execl("/bin/sh", "sh", "-c", rule->target, (char *)NULL);
+				_exit(127);
+			}
+			break;
+	}
+}
+
+void rules_evaluate(struct RULES *rules, time_t now, struct TELEMETRY *telemetry, struct STATUS *status, struct BATTERY *battery)
+{
+	int i;
+	struct RULE *rule;
+	float value;
+	bool cond;
+
+	for (i = 0; i < rules->count; i++) {
+		rule = &rules->rule[i];
+
+		switch (rule->source) {
+			case RULE_SRC_TELE:
+				value = *(float *)((uint8_t *)telemetry + rule->offset);
+				break;
+
+			case RULE_SRC_STAT:
+				value = (*((uint8_t *)status + rule->offset) >> rule->shift) & rule->mask;
+				break;
+
+			case RULE_SRC_BATT:
+				// SoC/SoH are meaningless until the estimator has anchored
+				if (!battery->valid) continue;
+				value = *(float *)((uint8_t *)battery + rule->offset);
+				break;
+
+			default:
+				continue;
+		}
+
+		// While active, the condition is widened by the hysteresis
+		switch (rule->op) {
+			case RULE_OP_LT: cond = value <  rule->threshold + (rule->active ? rule->hysteresis : 0);
+				break;
+
+			case RULE_OP_LE: cond = value <= rule->threshold + (rule->active ? rule->hysteresis : 0);
+				break;
+
+			case RULE_OP_GT: cond = value >  rule->threshold - (rule->active ? rule->hysteresis : 0);
+				break;
+
+			case RULE_OP_GE: cond = value >= rule->threshold - (rule->active ? rule->hysteresis : 0);
+				break;
+
+			case RULE_OP_EQ: cond = value == rule->threshold;
+				break;
+
+			case RULE_OP_NE: cond = value != rule->threshold;
+				break;
+
+			case RULE_OP_AND: cond = ((uint32_t) value & (uint32_t) rule->threshold) != 0;
+				break;
+
+			default: cond = false;
+				break;
+		}
+
+		if (rule->active) {
+			if (!cond) {
+				rule->active = false;
+				rule->pending = false;
+				rules_fire(rules, rule, value);
+			}
+		} else if (cond) {
+			if (!rule->pending) {
+				rule->pending = true;
+				rule->since = now;
+			}
+			if (difftime(now, rule->since) >= rule->holdoff) {
+				rule->active = true;
+				rules_fire(rules, rule, value);
+			}
+		} else {
+			rule->pending = false;
+		}
+	}
+}
@@ -0,0 +1,75 @@
+/*
+ * LT8491 - Buck/Boost Battery Charger with MPPT
+ * Copyright (C) 2021 Craig Peacock
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef MAIN_RULES_H_
+#define MAIN_RULES_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define RULES_MAX			32
+
+#define RULE_SRC_TELE			0
+#define RULE_SRC_STAT			1
+#define RULE_SRC_BATT			2
+
+#define RULE_OP_LT			0
+#define RULE_OP_LE			1
+#define RULE_OP_GT			2
+#define RULE_OP_GE			3
+#define RULE_OP_EQ			4
+#define RULE_OP_NE			5
+#define RULE_OP_AND			6
+
+#define RULE_ACTION_EXEC		0
+#define RULE_ACTION_UNIX		1
+
+struct TELEMETRY;
+struct STATUS;
+struct BATTERY;
+
+struct RULE {
+	char name[32];
+	uint8_t source;		// Structure the field is read from
+	uint8_t offset;		// Byte offset of field within structure
+	uint8_t shift;		// Bitfield position (status fields only)
+	uint8_t mask;		// Bitfield mask (status fields only)
+	uint8_t op;
+	uint8_t action;
+	float threshold;
+	float hysteresis;
+	int holdoff;		// Seconds condition must hold before firing
+	char target[128];	// Command or socket path
+	bool active;
+	bool pending;
+	time_t since;		// Time condition was first seen
+};
+
+struct RULES {
+	struct RULE rule[RULES_MAX];
+	int count;
+	int sock;
+};
+
+int rules_load(struct RULES *rules, char *filename);
+void rules_evaluate(struct RULES *rules, time_t now, struct TELEMETRY *telemetry, struct STATUS *status, struct BATTERY *battery);
+
+#endif